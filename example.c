@@ -45,5 +45,10 @@ int main () {
   printf("Convolutional code: %s\n", conv_code);
   printf("Result: %s Weight: %d\n", res->result, res->weight);
 
+  // Decoding the convolutional code on two threads (worthwhile for long shift registers)
+  res = viterbi_decode_parallel( conv_code, &t, 2 );
+
+  printf("Parallel result: %s Weight: %d\n", res->result, res->weight);
+
   return 0;
 }
@@ -1,13 +1,79 @@
 #include "viterbi.h"
 
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
 #define ASCII_OFFSET 48
 
+// Size of a cache line in bytes
+#define CACHE_LINE_SIZE 64
+
+// Number of butterflies a thread slice is aligned to
+// In a shift register trellis the destination states of a slice form whole cache lines
+// of both the path metrics and the one byte survivor decisions, so two threads never
+// write to the same cache line (the arrays are allocated cache line aligned)
+#define BUTTERFLY_ALIGNMENT CACHE_LINE_SIZE
+
+// Number of spins in the barrier before the thread yields the processor
+#define SPIN_BARRIER_YIELD 1024
+
 typedef struct viterbi_node {
     int weight;
     struct viterbi_node* father;
     unsigned int state_dec;
 } viterbi_node;
 
+// Structure for representing a butterfly of the trellis:
+// Two source states which transition to the same pair of destination states
+//  - src0:  Source state with the lower number
+//  - src1:  Source state with the higher number
+//  - dest0: Destination state on input 0
+//  - dest1: Destination state on input 1
+//  - codeXY: Decimal convolutional code of the transition from srcX on input Y
+//            (copied from the trellis, so the add-compare-select only reads the butterflies)
+
+typedef struct {
+    unsigned int src0;
+    unsigned int src1;
+    unsigned int dest0;
+    unsigned int dest1;
+    unsigned int code00;
+    unsigned int code01;
+    unsigned int code10;
+    unsigned int code11;
+} viterbi_butterfly;
+
+// Barrier on which the threads of the parallel decoder spin after each trellis step
+typedef struct {
+    atomic_uint count;
+    atomic_uint sense;
+    unsigned int num_threads;
+} spin_barrier;
+
+// Data shared by all threads of the parallel decoder
+//  - weights:   Path metrics of the current and the next trellis step
+//  - decisions: Survivor decision of every state in every trellis step
+//               (0: coming from src0 of the butterfly, 1: coming from src1)
+
+typedef struct {
+    viterbi_butterfly* butterflies;
+    unsigned int* code_segments;
+    unsigned int num_code_segments;
+    unsigned int num_states;
+    int* weights[2];
+    unsigned char* decisions;
+    spin_barrier barrier;
+    atomic_bool started;
+} viterbi_parallel_context;
+
+// Slice of the butterflies processed by one thread of the parallel decoder
+typedef struct {
+    viterbi_parallel_context* ctx;
+    unsigned int first_butterfly;
+    unsigned int last_butterfly;
+} viterbi_worker;
+
 // A function for calculating the power of a number
 unsigned int power (unsigned int base, unsigned int exp) {
     int n=1;
@@ -238,6 +304,219 @@ char* get_convolutional_code (char* state, encoder* enc, unsigned int num_encode
 }
 
 
+// Counting the bits which are set in a number
+unsigned int count_bits (unsigned int n) {
+    unsigned int count = 0;
+
+    while (n != 0) {
+        n &= n-1;
+        count++;
+    }
+
+    return count;
+}
+
+// Converting every code segment of a convolutional code to a decimal number
+unsigned int* get_code_segments (char* code, unsigned int num_code_segments, unsigned int code_length) {
+    unsigned int* code_segments = (unsigned int*) malloc( num_code_segments * sizeof(unsigned int) );
+
+    for (int i=0; i<num_code_segments; i++) {
+        code_segments[i] = 0;
+        for (int j=0; j<code_length; j++)
+            code_segments[i] = code_segments[i]*2 + (unsigned int)( code[i*code_length+j] - ASCII_OFFSET );
+    }
+
+    return code_segments;
+}
+
+// Grouping the states of the trellis into butterflies
+//  - tr:          Pointer to the trellis
+//  - butterflies: Array of num_states/2 butterflies to be filled, ordered by src0
+//  Returns false if the trellis cannot be split into butterflies
+
+bool get_butterflies (trellis* tr, viterbi_butterfly* butterflies) {
+    unsigned int num_states = tr->num_states;
+
+    unsigned int* predecessors = (unsigned int*) malloc( 2 * num_states * sizeof(unsigned int) );
+    unsigned int* num_predecessors = (unsigned int*) calloc( num_states, sizeof(unsigned int) );
+    bool* grouped = (bool*) calloc( num_states, sizeof(bool) );
+    bool success = true;
+
+    for (int i=0; i<num_states && success; i++) {
+        unsigned int dest [2] = { tr->states[i].state0_dec, tr->states[i].state1_dec };
+
+        for (int j=0; j<2; j++) {
+            if ( dest[j] >= num_states || num_predecessors[dest[j]] == 2 ) {
+                success = false;
+                break;
+            }
+            predecessors[ 2*dest[j] + num_predecessors[dest[j]] ] = i;
+            num_predecessors[dest[j]]++;
+        }
+    }
+
+    unsigned int num_butterflies = 0;
+
+    for (int i=0; i<num_states && success; i++) {
+        if ( grouped[i] )
+            continue;
+
+        unsigned int dest0 = tr->states[i].state0_dec;
+        unsigned int dest1 = tr->states[i].state1_dec;
+
+        if ( num_predecessors[dest0] != 2 || dest0 == dest1 ) {
+            success = false;
+            break;
+        }
+
+        unsigned int partner = predecessors[2*dest0] == i ? predecessors[2*dest0+1] : predecessors[2*dest0];
+
+        if ( partner == i || grouped[partner] || tr->states[partner].state0_dec != dest0 || tr->states[partner].state1_dec != dest1 ) {
+            success = false;
+            break;
+        }
+
+        butterflies[num_butterflies].src0  = i;
+        butterflies[num_butterflies].src1  = partner;
+        butterflies[num_butterflies].dest0 = dest0;
+        butterflies[num_butterflies].dest1 = dest1;
+        butterflies[num_butterflies].code00 = tr->states[i].code0_dec;
+        butterflies[num_butterflies].code01 = tr->states[i].code1_dec;
+        butterflies[num_butterflies].code10 = tr->states[partner].code0_dec;
+        butterflies[num_butterflies].code11 = tr->states[partner].code1_dec;
+        num_butterflies++;
+
+        grouped[i] = true;
+        grouped[partner] = true;
+    }
+
+    free(predecessors);
+    free(num_predecessors);
+    free(grouped);
+
+    return success;
+}
+
+// Add-compare-select for a range of butterflies in one trellis step
+//  - first, last:  Range of butterflies [first, last) to be processed
+//  - code_segment: Decimal representation of the code segment of the trellis step
+//  - weights:      Path metrics of the trellis step
+//  - new_weights:  Path metrics of the next trellis step to be computed
+//  - decisions:    Survivor decisions of the next trellis step to be computed (may be NULL)
+//  Ties are resolved in favour of src0, as in viterbi_decode()
+
+void add_compare_select (viterbi_butterfly* butterflies, unsigned int first, unsigned int last, unsigned int code_segment, int* weights, int* new_weights, unsigned char* decisions) {
+    for (unsigned int i=first; i<last; i++) {
+        viterbi_butterfly* bf = &butterflies[i];
+
+        int weight00 = weights[bf->src0] + count_bits( bf->code00 ^ code_segment );
+        int weight10 = weights[bf->src1] + count_bits( bf->code10 ^ code_segment );
+        int weight01 = weights[bf->src0] + count_bits( bf->code01 ^ code_segment );
+        int weight11 = weights[bf->src1] + count_bits( bf->code11 ^ code_segment );
+
+        new_weights[bf->dest0] = weight00 <= weight10 ? weight00 : weight10;
+        new_weights[bf->dest1] = weight01 <= weight11 ? weight01 : weight11;
+
+        if (decisions != NULL) {
+            decisions[bf->dest0] = weight00 <= weight10 ? 0 : 1;
+            decisions[bf->dest1] = weight01 <= weight11 ? 0 : 1;
+        }
+    }
+}
+
+// Getting the butterfly of every destination state
+unsigned int* get_dest_butterflies (viterbi_butterfly* butterflies, unsigned int num_butterflies, unsigned int num_states) {
+    unsigned int* dest_butterflies = (unsigned int*) malloc( num_states * sizeof(unsigned int) );
+
+    for (int i=0; i<num_butterflies; i++) {
+        dest_butterflies[ butterflies[i].dest0 ] = i;
+        dest_butterflies[ butterflies[i].dest1 ] = i;
+    }
+
+    return dest_butterflies;
+}
+
+// Tracing back the survivor path through a range of trellis steps
+//  - dest_butterflies: Butterfly of every destination state
+//  - decisions:        Survivor decisions of the trellis steps (num_steps * num_states)
+//  - state:            State at the end of the last trellis step
+//  - decoded_seq:      Bits decoded in the trellis steps, written from the last step to the first
+//  Returns the state at the beginning of the first trellis step
+
+unsigned int trace_back (trellis* tr, viterbi_butterfly* butterflies, unsigned int* dest_butterflies, unsigned char* decisions, unsigned int num_steps, unsigned int state, char* decoded_seq) {
+    for (int i=num_steps-1; i>=0; i--) {
+        viterbi_butterfly* bf = &butterflies[ dest_butterflies[state] ];
+        unsigned int father = decisions[ (size_t)i*tr->num_states + state ] == 0 ? bf->src0 : bf->src1;
+
+        decoded_seq[num_steps-1-i] = get_register_input( tr, father, state );
+        state = father;
+    }
+
+    return state;
+}
+
+// Spinning until all threads have arrived at the barrier
+//  - local_sense: Sense of the calling thread, flipped on every call
+void spin_barrier_wait (spin_barrier* barrier, unsigned int* local_sense) {
+    *local_sense ^= 1;
+
+    if ( atomic_fetch_add_explicit(&barrier->count, 1, memory_order_acq_rel) == barrier->num_threads-1 ) {
+        atomic_store_explicit(&barrier->count, 0, memory_order_relaxed);
+        atomic_store_explicit(&barrier->sense, *local_sense, memory_order_release);
+        return;
+    }
+
+    unsigned int spins = 0;
+    while ( atomic_load_explicit(&barrier->sense, memory_order_acquire) != *local_sense ) {
+        if ( ++spins % SPIN_BARRIER_YIELD == 0 )
+            sched_yield();
+    }
+}
+
+// Allocating memory aligned to a cache line
+void* cache_aligned_alloc (size_t size) {
+    return aligned_alloc( CACHE_LINE_SIZE, (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE );
+}
+
+// Splitting the butterflies into one slice per thread
+// The slices are multiples of BUTTERFLY_ALIGNMENT long, so trailing threads may get an empty slice
+// Returns the number of threads with a non-empty slice
+
+unsigned int partition_butterflies (viterbi_worker* workers, unsigned int num_threads, unsigned int num_butterflies) {
+    unsigned int slice_length = (num_butterflies + num_threads - 1) / num_threads;
+    slice_length = (slice_length + BUTTERFLY_ALIGNMENT - 1) / BUTTERFLY_ALIGNMENT * BUTTERFLY_ALIGNMENT;
+
+    for (int i=0; i<num_threads; i++) {
+        workers[i].first_butterfly = i * slice_length < num_butterflies ? i * slice_length : num_butterflies;
+        workers[i].last_butterfly = (i+1) * slice_length < num_butterflies ? (i+1) * slice_length : num_butterflies;
+    }
+
+    return (num_butterflies + slice_length - 1) / slice_length;
+}
+
+// Running the add-compare-select of all trellis steps on the slice of a thread
+void* viterbi_worker_run (void* arg) {
+    viterbi_worker* worker = (viterbi_worker*) arg;
+    viterbi_parallel_context* ctx = worker->ctx;
+    unsigned int local_sense = 0;
+
+    // The slices are only final once all threads have been created
+    unsigned int spins = 0;
+    while ( !atomic_load_explicit(&ctx->started, memory_order_acquire) ) {
+        if ( ++spins % SPIN_BARRIER_YIELD == 0 )
+            sched_yield();
+    }
+
+    for (int i=0; i<ctx->num_code_segments; i++) {
+        add_compare_select( ctx->butterflies, worker->first_butterfly, worker->last_butterfly, ctx->code_segments[i],
+                            ctx->weights[i%2], ctx->weights[(i+1)%2], ctx->decisions + (size_t)i*ctx->num_states );
+        spin_barrier_wait(&ctx->barrier, &local_sense);
+    }
+
+    return NULL;
+}
+
+
 /*-------------------------------------------------------------------*/
 //------------------------- USER FUNCTIONS --------------------------*/
 
@@ -377,6 +656,197 @@ viterbi_result* viterbi_decode (char* code, trellis* tr) {
     return &res;
 }
 
+// Decoding a convolutional code using the Viterbi algorithm on several threads
+//  - code:        Bit sequence to be decoded
+//  - tr:          Pointer to the trellis to be used for decoding
+//  - num_threads: Number of threads the states of each trellis step are split across
+
+viterbi_result* viterbi_decode_parallel (char* code, trellis* tr, unsigned int num_threads) {
+    if ( !is_bit_sequence(code) ) {
+        fprintf(stderr, "ERROR: viterbi_decode_parallel: %s is not a bit sequence (must of consist of 0 and 1)\n", code);
+        return NULL;
+    }
+
+    unsigned int num_states = power(2, tr->state_length);
+    unsigned int num_butterflies = num_states / 2;
+
+    viterbi_butterfly* butterflies = (viterbi_butterfly*) malloc( num_butterflies * sizeof(viterbi_butterfly) );
+
+    if ( !get_butterflies(tr, butterflies) ) {
+        fprintf(stderr, "ERROR: viterbi_decode_parallel: The trellis cannot be split into butterflies\n");
+        free(butterflies);
+        return NULL;
+    }
+
+    if (num_threads == 0)
+        num_threads = 1;
+    if (num_threads > num_butterflies)
+        num_threads = num_butterflies;
+
+    viterbi_worker* workers = (viterbi_worker*) malloc( num_threads * sizeof(viterbi_worker) );
+    pthread_t* threads = (pthread_t*) malloc( num_threads * sizeof(pthread_t) );
+
+    num_threads = partition_butterflies(workers, num_threads, num_butterflies);
+
+    viterbi_parallel_context ctx;
+    ctx.butterflies = butterflies;
+    ctx.num_code_segments = strlen(code) / tr->code_length;
+    ctx.num_states = num_states;
+    ctx.code_segments = get_code_segments(code, ctx.num_code_segments, tr->code_length);
+    ctx.weights[0] = (int*) cache_aligned_alloc( num_states * sizeof(int) );
+    ctx.weights[1] = (int*) cache_aligned_alloc( num_states * sizeof(int) );
+    ctx.decisions = (unsigned char*) cache_aligned_alloc( (size_t)ctx.num_code_segments * num_states );
+    memset( ctx.weights[0], 0, num_states * sizeof(int) );
+    atomic_init(&ctx.barrier.count, 0);
+    atomic_init(&ctx.barrier.sense, 0);
+    atomic_init(&ctx.started, false);
+
+    for (int i=0; i<num_threads; i++)
+        workers[i].ctx = &ctx;
+
+    // The calling thread processes the first slice itself
+    // If a thread cannot be created, the butterflies are split among the threads created so far
+    for (int i=1; i<num_threads; i++) {
+        if ( pthread_create( &threads[i], NULL, viterbi_worker_run, &workers[i] ) != 0 ) {
+            num_threads = i;
+            partition_butterflies(workers, num_threads, num_butterflies);
+            break;
+        }
+    }
+
+    ctx.barrier.num_threads = num_threads;
+    atomic_store_explicit(&ctx.started, true, memory_order_release);
+
+    viterbi_worker_run(&workers[0]);
+
+    for (int i=1; i<num_threads; i++)
+        pthread_join( threads[i], NULL );
+
+    int* weights = ctx.weights[ctx.num_code_segments%2];
+    int smallest_weight = INT_MAX;
+    int smallest_weight_state = 0;
+
+    for (int i=0; i<num_states; i++) {
+      if ( weights[i] < smallest_weight ) {
+        smallest_weight = weights[i];
+        smallest_weight_state = i;
+      }
+    }
+
+    unsigned int* dest_butterflies = get_dest_butterflies(butterflies, num_butterflies, num_states);
+
+    char* viterbi_decoded_seq = (char*) malloc(ctx.num_code_segments+1);
+    trace_back( tr, butterflies, dest_butterflies, ctx.decisions, ctx.num_code_segments, smallest_weight_state, viterbi_decoded_seq );
+    viterbi_decoded_seq[ctx.num_code_segments] = '\0';
+
+    static viterbi_result res;
+    res.result = viterbi_decoded_seq;
+    res.weight = smallest_weight;
+
+    free(dest_butterflies);
+    free(threads);
+    free(workers);
+    free(ctx.decisions);
+    free(ctx.weights[0]);
+    free(ctx.weights[1]);
+    free(ctx.code_segments);
+    free(butterflies);
+
+    return &res;
+}
+
+// Decoding a convolutional code using the Viterbi algorithm with checkpointed traceback
+//  - code: Bit sequence to be decoded
+//  - tr:   Pointer to the trellis to be used for decoding
+
+viterbi_result* viterbi_decode_checkpointed (char* code, trellis* tr) {
+    if ( !is_bit_sequence(code) ) {
+        fprintf(stderr, "ERROR: viterbi_decode_checkpointed: %s is not a bit sequence (must of consist of 0 and 1)\n", code);
+        return NULL;
+    }
+
+    unsigned int num_states = power(2, tr->state_length);
+    unsigned int num_butterflies = num_states / 2;
+
+    viterbi_butterfly* butterflies = (viterbi_butterfly*) malloc( num_butterflies * sizeof(viterbi_butterfly) );
+
+    if ( !get_butterflies(tr, butterflies) ) {
+        fprintf(stderr, "ERROR: viterbi_decode_checkpointed: The trellis cannot be split into butterflies\n");
+        free(butterflies);
+        return NULL;
+    }
+
+    unsigned int num_code_segments = strlen(code) / tr->code_length;
+    unsigned int* code_segments = get_code_segments(code, num_code_segments, tr->code_length);
+
+    // The path metrics are saved every segment_length trellis steps,
+    // with segment_length being the rounded up square root of the number of steps
+    unsigned int segment_length = 1;
+    while ( segment_length * segment_length < num_code_segments )
+        segment_length++;
+
+    unsigned int num_segments = (num_code_segments + segment_length - 1) / segment_length;
+
+    int* checkpoints = (int*) malloc( (size_t)num_segments * num_states * sizeof(int) );
+    int* weights[2];
+    weights[0] = (int*) calloc( num_states, sizeof(int) );
+    weights[1] = (int*) malloc( num_states * sizeof(int) );
+
+    // Forward pass: only the path metrics at the beginning of each segment are kept
+    for (int i=0; i<num_code_segments; i++) {
+        if ( i % segment_length == 0 )
+            memcpy( checkpoints + (size_t)(i/segment_length)*num_states, weights[i%2], num_states * sizeof(int) );
+
+        add_compare_select( butterflies, 0, num_butterflies, code_segments[i], weights[i%2], weights[(i+1)%2], NULL );
+    }
+
+    int smallest_weight = INT_MAX;
+    int smallest_weight_state = 0;
+
+    for (int i=0; i<num_states; i++) {
+      if ( weights[num_code_segments%2][i] < smallest_weight ) {
+        smallest_weight = weights[num_code_segments%2][i];
+        smallest_weight_state = i;
+      }
+    }
+
+    unsigned int* dest_butterflies = get_dest_butterflies(butterflies, num_butterflies, num_states);
+    unsigned char* decisions = (unsigned char*) malloc( (size_t)segment_length * num_states );
+
+    char* viterbi_decoded_seq = (char*) malloc(num_code_segments+1);
+    viterbi_decoded_seq[num_code_segments] = '\0';
+
+    // Traceback: the survivor decisions are recomputed segment by segment from the checkpoints,
+    // starting with the last segment
+    unsigned int state = smallest_weight_state;
+
+    for (int i=num_segments-1; i>=0; i--) {
+        unsigned int first_step = i * segment_length;
+        unsigned int num_steps = num_code_segments - first_step < segment_length ? num_code_segments - first_step : segment_length;
+
+        memcpy( weights[0], checkpoints + (size_t)i*num_states, num_states * sizeof(int) );
+
+        for (int j=0; j<num_steps; j++)
+            add_compare_select( butterflies, 0, num_butterflies, code_segments[first_step+j], weights[j%2], weights[(j+1)%2], decisions + (size_t)j*num_states );
+
+        state = trace_back( tr, butterflies, dest_butterflies, decisions, num_steps, state, viterbi_decoded_seq + num_code_segments - first_step - num_steps );
+    }
+
+    static viterbi_result res;
+    res.result = viterbi_decoded_seq;
+    res.weight = smallest_weight;
+
+    free(decisions);
+    free(dest_butterflies);
+    free(weights[0]);
+    free(weights[1]);
+    free(checkpoints);
+    free(code_segments);
+    free(butterflies);
+
+    return &res;
+}
+
 // Encoding a bit sequence with a convolutional code
 //  - seq:           Bit sequence to be encoded
 //  - enc:           Array of encoders
@@ -120,6 +120,29 @@ void create_trellis (trellis* tr, unsigned int num_bits, encoder* enc, unsigned
 
 viterbi_result* viterbi_decode (char* code, trellis* tr);
 
+// Decoding a convolutional code using the Viterbi algorithm on several threads
+// The states of each trellis step are split into butterflies (pairs of states transitioning
+// to the same two states) and every thread computes a contiguous slice of them.
+// The threads wait for each other on a spin barrier after every trellis step, so
+// num_threads should not exceed the number of processor cores.
+// Worthwhile for large trellises (14 or more bits in the shift register).
+//  - code:        Bit sequence to be decoded
+//  - tr:          Pointer to the trellis to be used for decoding
+//  - num_threads: Number of threads the states of each trellis step are split across
+
+viterbi_result* viterbi_decode_parallel (char* code, trellis* tr, unsigned int num_threads);
+
+// Decoding a convolutional code using the Viterbi algorithm with checkpointed traceback
+// Returns the same result as viterbi_decode() but only saves the path metrics every
+// sqrt(N) trellis steps (N: number of code segments) instead of keeping the whole grid.
+// The survivor path is recomputed segment by segment from these checkpoints during the
+// traceback, which takes about twice the computation but only O(sqrt(N) * num_states)
+// memory instead of O(N * num_states). Meant for very long convolutional codes.
+//  - code: Bit sequence to be decoded
+//  - tr:   Pointer to the trellis to be used for decoding
+
+viterbi_result* viterbi_decode_checkpointed (char* code, trellis* tr);
+
 // Encoding a bit sequence with a convolutional code
 //  - seq:           Bit sequence to be encoded
 //  - enc:           Array of encoders